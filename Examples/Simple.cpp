@@ -73,6 +73,20 @@ int main()
         shut_down = true; 
     });
 
+    // a method with a return value, called through Request. 
+    peer_two.Bind("describe", [&](const std::string name, const int count, const float weight) {
+        return name + " x" + std::to_string(count) + " @ " + std::to_string(weight);
+    });
+
+    peer_one.OnRequestFailed([&](const std::string& func_name) {
+        std::cout << "no reply to " << func_name << std::endl;
+    });
+
+    // the reply comes back on the Loop thread. 
+    peer_one.Request("describe", [&](const std::string result) {
+        std::cout << "describe: " << result << std::endl;
+    }, "bottle", 3, 0.5f);
+
     // broadcast to three and two. 
     peer_one.Call("update", " Hello ! ");
 
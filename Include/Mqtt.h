@@ -1,11 +1,42 @@
 #pragma once
 #include <map>
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include <chrono>
 #include <functional>
-#include <mosquittopp.h>
+#include <mosquitto.h>
 #include "Shared.h"
 
+// multi-topic SUBSCRIBE and the v5 property API came with libmosquitto 1.6.
+#if !defined(LIBMOSQUITTO_VERSION_NUMBER) || LIBMOSQUITTO_VERSION_NUMBER < 1006000
+#error "MqttRPC needs libmosquitto 1.6 or later, update External/mosquitto."
+#endif
+
 namespace mqtt
 {
+    enum class Protocol
+    {
+        V311,
+        V5
+    };
+
+    // request metadata, sent as v5 properties. ignored on v3.1.1 connections.
+    struct MessageProperties
+    {
+        bool has_method = false;            // user property "m", also tells the receiver the sender speaks v5.
+        uint32_t method_id = 0;             // value of "m", 0 when the method travels in the payload.
+        std::vector<uint8_t> correlation;   // correlation data, pairs a request with its reply.
+        std::string method;                 // not sent. name behind method_id, for the DowngradeHandler.
+    };
+
+    typedef std::function<void(const shared::PayLoadSharedPtr, const std::string& topic)> MessageHandlerType;
+    typedef std::function<void(const shared::PayLoadSharedPtr, const std::string& topic, const MessageProperties& properties)> MessageHandlerWithPropertiesType;
+    // rc is a mosq_err_t for publishes, the SUBACK reason code for subscriptions.
+    typedef std::function<void(const std::string& topic, int rc)> ErrorHandlerType;
+    // rewrites a payload queued with a method_id so it carries the method itself, when it has to go out on v3.1.1.
+    typedef std::function<void(shared::PayLoadType& payload, const MessageProperties& properties)> DowngradeHandlerType;
+
     struct AsyncData
     {
         AsyncData() :
@@ -16,32 +47,104 @@ namespace mqtt
 
         std::unique_ptr<shared::PayLoadType> payload;
         std::string topic;
+        MessageProperties properties;
 
         MemoryPoolTrait(AsyncData, 1024)
     };
 
-    class MQTT : public mosqpp::mosquittopp
+    // mosquittopp doesn't expose multi-topic subscribe, so MQTT drives a libmosquitto handle directly.
+    class MQTT
     {
     public:
         MQTT(){};
+        ~MQTT();
 
-        void Connect(const std::string& clientid, const std::string& ip, const int port);
-        void Subscribe(const std::string& topic, std::function<void(const shared::PayLoadSharedPtr,const std::string& topic)> message_handler);
-        void PublishAsync(const std::string& topic, shared::PayLoadPtr);
+        // Protocol::V5 negotiates topic aliases and carries MessageProperties natively. 
+        // falls back to v3.1.1 if the broker doesn't support v5.
+        void Connect(const std::string& clientid, const std::string& ip, const int port, const Protocol protocol = Protocol::V311);
+        void Subscribe(const std::string& topic, MessageHandlerType message_handler);
+        void Subscribe(const std::string& topic, MessageHandlerWithPropertiesType message_handler);
+        // false if the publish queue is full, the message is dropped.
+        bool PublishAsync(const std::string& topic, shared::PayLoadPtr, MessageProperties properties = MessageProperties());
         void Loop();
 
+        // called on the Loop thread when a queued publish is rejected by libmosquitto and dropped,
+        // or when the broker refuses a subscription.
+        void SetErrorHandler(ErrorHandlerType handler);
+        // called at the end of every Loop, on its thread. keep it cheap.
+        void AddTicker(std::function<void()> ticker);
+        // needed for messages queued with a method_id while on v5 that only get sent after falling back to v3.1.1.
+        // without one they are dropped and reported.
+        void SetDowngradeHandler(DowngradeHandlerType handler);
+        // publishes dropped so far, queue full or rejected.
+        uint64_t DroppedMessages() const { return Dropped.load(std::memory_order_relaxed); }
+
+        bool IsV5() const { return Version == Protocol::V5; }
+
         static MQTT& Instance();
 
     private:
 
-        virtual void on_connect(int rc) override;
-        virtual void on_disconnect(int rc) override;
-        virtual void on_message(const struct mosquitto_message *message) override;
+        void on_connect(int rc, const mosquitto_property* props);
+        void on_disconnect(int rc);
+        void on_message(const struct mosquitto_message *message, const mosquitto_property* props);
+        void on_subscribe(int mid, int qos_count, const int* granted_qos);
 
-        // Message Handlers. 
-        std::multimap<std::string, std::function<void(std::shared_ptr<shared::PayLoadType>, const std::string& topic)>> MessageHandlers;
-        // Async Publish queue. 
+        void ReportError(const std::string& topic, int rc);
+
+        int Publish(AsyncData& data);
+
+        // send pending subscriptions, packed several topics to a SUBSCRIBE packet.
+        void FlushSubscriptions();
+        // try to get back to the broker, backing off exponentially between attempts.
+        void TryReconnect();
+        void ScheduleReconnect();
+        void ConnectionLost();
+        void StartConnecting(int res);
+
+        typedef std::chrono::steady_clock Clock;
+
+        enum class State
+        {
+            Disconnected,
+            Connecting, // waiting for CONNACK.
+            Connected
+        };
+
+        struct mosquitto* handle = nullptr;
+        State ConnectionState = State::Disconnected;
+        std::atomic<Protocol> Version{ Protocol::V311 };
+
+        // Message Handlers. Keys double as the subscription table replayed on every connect.
+        std::multimap<std::string, MessageHandlerWithPropertiesType> MessageHandlers;
+        // topics not yet sent on the current connection.
+        std::vector<std::string> PendingSubscriptions;
+        // sent, waiting for SUBACK. by message id.
+        std::unordered_map<int, std::vector<std::string>> SubscriptionsInFlight;
+        // Async Publish queue. Held while disconnected.
         shared::bounded_queue<AsyncData*> ToPublishQueue;
+        // dequeued but couldn't go out, retried before anything else to keep ordering.
+        AsyncData* HeldPublish = nullptr;
+
+        ErrorHandlerType ErrorHandler;
+        DowngradeHandlerType DowngradeHandler;
+        std::vector<std::function<void()>> Tickers;
+        std::atomic<uint64_t> Dropped{ 0 };
+
+        // v5 outbound topic aliases, only valid for the current connection. 
+        std::unordered_map<std::string, uint16_t> TopicAliases;
+        // as granted by the broker in CONNACK.
+        uint16_t TopicAliasMaximum = 0;
+
+        Clock::duration ReconnectDelay = MinReconnectDelay;
+        Clock::time_point NextReconnect;
+        // a handshake that hasn't finished by then is abandoned.
+        Clock::time_point ConnectDeadline;
+
+        static const int MaxTopicsPerSubscribe = 128;
+        static constexpr Clock::duration MinReconnectDelay = std::chrono::milliseconds(250);
+        static constexpr Clock::duration MaxReconnectDelay = std::chrono::seconds(30);
+        static constexpr Clock::duration ConnectTimeout = std::chrono::seconds(30);
     };
 
 }
@@ -1,6 +1,8 @@
 #pragma  once
 
 #include <tuple>
+#include <array>
+#include <utility>
 #include <type_traits>
 #include <stack>
 #include <sstream>
@@ -17,6 +19,11 @@
 
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
 #include "Mqtt.h"
 
 namespace rpc
@@ -44,12 +51,9 @@ namespace rpc
 
         // Wire->DataType. 
         template<class T>
-        inline auto get(ArgumentSourceType& args)
+        inline auto from_bytes(const std::vector<uint8_t>& Source)
         {
             // T must be default constructible
-            std::vector<uint8_t>  Source = args.top();
-            args.pop();
-
             typename std::remove_const<typename std::remove_reference<T>::type>::type val;
 
             std::stringstream ssout(std::stringstream::in | std::stringstream::out | std::stringstream::binary);
@@ -116,24 +120,43 @@ namespace rpc
                 : _f(f) {}
 
             void operator()(ArgumentSourceType& args, std::string* out_opt) const {
-                call(args, out_opt, std::is_void<R>());
+                // not a call to this signature. 
+                if (args.size() < sizeof...(Args))
+                    return;
+
+                // the last argument is on top. lay them out in order, so it doesn't matter in which order 
+                // the compiler evaluates the conversions below. 
+                ArgumentArray ordered;
+                for (size_t ctr = sizeof...(Args); ctr > 0; ctr--)
+                {
+                    ordered[ctr - 1] = std::move(args.top());
+                    args.pop();
+                }
+                call(ordered, out_opt, std::is_void<R>(), std::index_sequence_for<Args...>());
             }
 
         private:
+
+            typedef std::array<std::vector<uint8_t>, sizeof...(Args)> ArgumentArray;
           
             // void return
-            void call(ArgumentSourceType& args, std::string*, std::true_type) const {
-                _f(get<Args>(args)...);
+            template<size_t... I>
+            void call(ArgumentArray& args, std::string*, std::true_type, std::index_sequence<I...>) const {
+                _f(from_bytes<Args>(args[I])...);
             }
 
             // non-void return
-            void call(ArgumentSourceType& args, std::string* out_opt, std::false_type) const {
+            template<size_t... I>
+            void call(ArgumentArray& args, std::string* out_opt, std::false_type, std::index_sequence<I...> indices) const {
                 if (!out_opt) // no return wanted, redirect
-                    return call(args, nullptr, std::true_type());
-
-                std::stringstream conv;
-                if (!(conv << invoker<R>{_f, get<Args>(args)...}.result))
-                    throw std::runtime_error("bad return in stream_function");
+                    return call(args, nullptr, std::true_type(), indices);
+
+                // binary, so the caller of PeerConnection::Request can read it back with from_bytes.
+                std::stringstream conv(std::stringstream::in | std::stringstream::out | std::stringstream::binary);
+                {
+                    OutputArchive output(conv);
+                    output(invoker<R>{_f, from_bytes<Args>(args[I])...}.result);
+                }
                 *out_opt = conv.str();
             }
 
@@ -142,6 +165,100 @@ namespace rpc
 
         template<class Sig, class F>
         stream_function_<F, Sig> stream_function(F f) { return { f }; }
+
+        // compact id of a method name, sent in place of the name on v5. 32 bit FNV-1a, never 0.
+        inline uint32_t MethodId(const std::string& name)
+        {
+            uint32_t hash = 2166136261u;
+            for (auto c : name)
+            {
+                hash ^= (uint8_t)c;
+                hash *= 16777619u;
+            }
+            return hash != 0 ? hash : 1;
+        }
+
+        // reply handler of PeerConnection::Request, gets the serialized return value. 
+        typedef std::function<void(const std::vector<uint8_t>&)> ResultHandler;
+
+        template <typename Callback>
+        typename std::enable_if<function_traits<Callback>::arity == 0, ResultHandler>::type make_result_handler(Callback F)
+        {
+            return [F](const std::vector<uint8_t>&) { F(); };
+        }
+
+        template <typename Callback>
+        typename std::enable_if<function_traits<Callback>::arity == 1, ResultHandler>::type make_result_handler(Callback F)
+        {
+            typedef typename function_traits<Callback>::template arg<0>::type result_type;
+            return [F](const std::vector<uint8_t>& result) { F(from_bytes<result_type>(result)); };
+        }
+
+        // requests waiting for a reply, and replies of idempotent methods keyed by method + serialized arguments. 
+        // cached replies live in a bounded LRU. safe to use from multiple threads. 
+        class CallCache
+        {
+        public:
+            enum class Lookup
+            {
+                Hit,    // result holds the cached reply.
+                Joined, // an identical request is in flight, handler gets its reply.
+                Send    // handler waits on a new request under id, send it.
+            };
+
+            CallCache(size_t InCapacity = 1024)
+                : capacity(InCapacity) {}
+
+            void SetTTL(const std::string& method, std::chrono::milliseconds ttl);
+
+            Lookup Begin(const std::string& method, const std::vector<uint8_t>& args, ResultHandler handler, uint64_t id, std::vector<uint8_t>& result);
+            // request couldn't be sent, its handlers are dropped. returns how many there were. 
+            size_t Cancel(uint64_t id);
+            // gives up on requests unanswered for RequestTimeout, one method name per handler dropped. 
+            std::vector<std::string> Expire();
+            // handlers waiting on id, empty if it isn't ours. the reply is cached if the method is cacheable. 
+            std::vector<ResultHandler> Complete(uint64_t id, const std::vector<uint8_t>& result);
+
+            void Invalidate(const std::string& method);
+
+        private:
+            typedef std::chrono::steady_clock Clock;
+
+            struct Entry
+            {
+                std::string             key;
+                std::string             method;
+                Clock::time_point       expires;
+                std::vector<uint8_t>    result;
+            };
+
+            struct InFlight
+            {
+                std::string                 key;
+                std::string                 method;
+                Clock::time_point           deadline;
+                bool                        cacheable;
+                std::vector<ResultHandler>  handlers;
+            };
+
+            // lock held. 
+            std::unordered_map<uint64_t, InFlight>::iterator Forget(std::unordered_map<uint64_t, InFlight>::iterator request);
+
+            size_t const capacity;
+            std::mutex lock;
+            std::unordered_map<std::string, std::chrono::milliseconds> ttls;
+            std::list<Entry> lru; // most recent at the front.
+            std::unordered_map<std::string, std::list<Entry>::iterator> index;
+            std::unordered_map<uint64_t, InFlight> in_flight;
+            std::unordered_map<std::string, uint64_t> in_flight_keys; // cacheable requests only, for merging. 
+            // same timeout for all, so this is in deadline order. may name requests already answered. 
+            std::deque<std::pair<Clock::time_point, uint64_t>> deadlines;
+            // in_flight.size(), readable without the lock. 
+            std::atomic<size_t> pending{ 0 };
+
+            // a request unanswered for this long is given up on. 
+            static constexpr Clock::duration RequestTimeout = std::chrono::seconds(30);
+        };
     }
 
 
@@ -166,83 +283,107 @@ namespace rpc
     public:
         void Init(const std::string my_topic, const std::string peer_topic);  
 
+        // fire and forget. false if the call couldn't be queued. 
         template <typename... Args>
-        void Call(const std::string& func_name, Args... args)
+        bool Call(const std::string& func_name, Args... args)
         {
-            detail::ArgumentSourceType stack;
-
-            auto serializer = [&](auto object) {
-                //  serialize Val. 
-                std::stringstream ss(std::stringstream::in | std::stringstream::out | std::stringstream::binary);
-                // 
-                serialize(object, ss);
-                // copy the stringstream to a byte vector. 
-                std::vector<uint8_t> s;
-                std::copy(std::istreambuf_iterator<char>(ss), std::istreambuf_iterator<char>(), std::back_inserter(s));
-                stack.push(s);
-            };
-
-            // make a tuple pack of the arguments. 
-            auto tuple_pack = std::make_tuple(std::forward<Args>(args)...);
-            // loop through all arguments and serialize. 
-            detail::for_each_in_tuple(tuple_pack, serializer);
+            return Send(func_name, PackArguments(args...));
+        }
 
-            // push function name.
-            stack.push(std::vector<uint8_t>(func_name.begin(), func_name.end()));
-            //  serialize stack. 
+        // calls func_name on the peer and hands its return value to on_result, on the thread running mqtt::MQTT::Loop. 
+        // on_result takes the return type, or nothing for void methods. 
+        // methods marked with SetCacheable are answered from cache within their ttl, with on_result running right away, 
+        // and identical requests in flight share one round trip. false if the request couldn't be queued. 
+        // a request unanswered for 30s is given up on, on_result never runs and OnRequestFailed is told instead. 
+        template <typename Callback, typename... Args>
+        bool Request(const std::string& func_name, Callback on_result, Args... args)
+        {
+            //  serialize the arguments on their own, they are the cache key. on v5 they are the whole payload, 
+            //  otherwise they travel as one argument of request_method. 
+            detail::ArgumentSourceType stack = PackArguments(args...);
             std::stringstream ss(std::stringstream::in | std::stringstream::out | std::stringstream::binary);
             {
                 cereal::BinaryOutputArchive output(ss);
                 output(stack);
             }
-            // copy the stringstream to the payload.
-            shared::PayLoadPtr payload(new shared::PayLoadType());
-            std::copy(std::istreambuf_iterator<char>(ss), std::istreambuf_iterator<char>(), std::back_inserter(*payload));
-            // put the payload on the wire.
-            mqtt::MQTT::Instance().PublishAsync( peer_topic + "/" + my_topic, std::move(payload));
+            std::vector<uint8_t> arguments;
+            std::copy(std::istreambuf_iterator<char>(ss), std::istreambuf_iterator<char>(), std::back_inserter(arguments));
+
+            auto handler = detail::make_result_handler(on_result);
+            uint64_t id = next_request_id++;
+            std::vector<uint8_t> result;
+
+            switch (call_cache.Begin(func_name, arguments, handler, id, result))
+            {
+            case detail::CallCache::Lookup::Hit:
+                handler(result);
+                return true;
+            case detail::CallCache::Lookup::Joined:
+                return true;
+            case detail::CallCache::Lookup::Send:
+                break;
+            }
+
+            if (!SendRequest(id, func_name, arguments))
+            {
+                // our own caller learns from the return value, anyone merged into it from the failure handler. 
+                auto dropped = call_cache.Cancel(id);
+                for (size_t ctr = 1; ctr < dropped; ctr++)
+                    RequestFailed(func_name);
+                return false;
+            }
+            return true;
         }
 
 
         typedef std::function<void(detail::ArgumentSourceType&, std::string*)> func_type;
-        typedef std::unordered_map<std::string, func_type> dict_type;
+
+        struct BoundMethod
+        {
+            std::string name;
+            func_type   func;
+        };
+        // keyed by detail::MethodId of the name.
+        typedef shared::rcu_map<uint32_t, BoundMethod> dict_type;
 
 
         template <typename Functor>
         typename std::enable_if<detail::function_traits<Functor>::arity == 0>::type BindImpl(const std::string& FuncName, Functor F) 
         {
             typedef typename detail::function_traits<Functor> traits;
-            function_registry[FuncName] = detail::stream_function<typename traits::result_type ,void>(F);
+            SetMethod(FuncName, detail::stream_function<typename traits::result_type ,void>(F));
         }
 
         template <typename Functor>
         typename std::enable_if<detail::function_traits<Functor>::arity == 1>::type BindImpl(const std::string& FuncName, Functor F) 
         {
             typedef typename detail::function_traits<Functor> traits;
-            function_registry[FuncName] = detail::stream_function<typename traits::result_type(typename traits::template arg<0>::type)>(F);
+            SetMethod(FuncName, detail::stream_function<typename traits::result_type(typename traits::template arg<0>::type)>(F));
         }
 
         template <typename Functor>
         typename std::enable_if<detail::function_traits<Functor>::arity == 2>::type BindImpl(const std::string& FuncName, Functor F) 
         {
             typedef typename detail::function_traits<Functor> traits;
-            function_registry[FuncName] = detail::stream_function<typename  traits::result_type(typename  traits::template arg<0>::type, typename  traits::template arg<1>::type)>(F);
+            SetMethod(FuncName, detail::stream_function<typename  traits::result_type(typename  traits::template arg<0>::type, typename  traits::template arg<1>::type)>(F));
         }
 
         template <typename Functor>
         typename std::enable_if<detail::function_traits<Functor>::arity == 3>::type BindImpl(const std::string& FuncName, Functor F)
         {
             typedef typename detail::function_traits<Functor> traits;
-            function_registry[FuncName] = detail::stream_function<typename  traits::result_type(typename  traits::template arg<0>::type, typename  traits::template arg<1>::type, typename  traits::template arg<2>::type)>(F);
+            SetMethod(FuncName, detail::stream_function<typename  traits::result_type(typename  traits::template arg<0>::type, typename  traits::template arg<1>::type, typename  traits::template arg<2>::type)>(F));
         }
 
         template <typename Functor>
         typename std::enable_if<detail::function_traits<Functor>::arity == 4>::type BindImpl(const std::string& FuncName, Functor F) 
         {
             typedef typename detail::function_traits<Functor> traits;
-            function_registry[FuncName] = detail::stream_function<typename  traits::result_type(traits::template arg<0>::type, traits::template arg<1>::type, traits::template arg<2>::type, traits::template arg<3>::type)>(F);
+            SetMethod(FuncName, detail::stream_function<typename  traits::result_type(traits::template arg<0>::type, traits::template arg<1>::type, traits::template arg<2>::type, traits::template arg<3>::type)>(F));
         }
 
 
+        // throws std::invalid_argument if FuncName's method id is taken by another bound name. 
         template <typename Functor>
         void Bind(const std::string& FuncName, Functor F) 
         {
@@ -250,12 +391,77 @@ namespace rpc
             BindImpl(FuncName, F);
         }
 
+        // safe while calls are being dispatched, handlers already running finish on the old binding. 
+        bool Unbind(const std::string& FuncName);
+
+        // mark a method as idempotent. Request answers repeats with the same arguments from cache within ttl. 
+        // plain Call is never cached. 
+        void SetCacheable(const std::string& FuncName, std::chrono::milliseconds ttl);
+
+        // tell every peer caching replies of my FuncName to drop them, e.g. after the data behind it changed. 
+        // false if it couldn't be queued. 
+        bool Invalidate(const std::string& FuncName);
+
+        // called with the method name for every Request that gets no reply: unanswered for 30s, 
+        // or merged into one that couldn't be queued. on_result never runs for those. 
+        void OnRequestFailed(std::function<void(const std::string& func_name)> handler);
+
         static std::string source_topic_in_progress;
 
     private:
+
+        template <typename... Args>
+        static detail::ArgumentSourceType PackArguments(Args... args)
+        {
+            detail::ArgumentSourceType stack;
+
+            auto serializer = [&](auto object) {
+                //  serialize Val. 
+                std::stringstream ss(std::stringstream::in | std::stringstream::out | std::stringstream::binary);
+                // 
+                serialize(object, ss);
+                // copy the stringstream to a byte vector. 
+                std::vector<uint8_t> s;
+                std::copy(std::istreambuf_iterator<char>(ss), std::istreambuf_iterator<char>(), std::back_inserter(s));
+                stack.push(s);
+            };
+
+            // make a tuple pack of the arguments. 
+            auto tuple_pack = std::make_tuple(std::forward<Args>(args)...);
+            // loop through all arguments and serialize. 
+            detail::for_each_in_tuple(tuple_pack, serializer);
+            return stack;
+        }
+
+        // a packed call on its way to the peer. method id and marker as v5 properties, or the name on top of the stack. 
+        bool Send(const std::string& func_name, detail::ArgumentSourceType stack);
+        // v5 carries the request id as correlation data, v3.1.1 wraps the call into request_method / reply_method. 
+        bool SendRequest(uint64_t id, const std::string& func_name, const std::vector<uint8_t>& arguments);
+        bool SendReply(uint64_t id, const std::string& result);
+        // true if the peer can take the method as an id. 
+        bool PeerTakesIds() const;
+        // mqtt::DowngradeHandlerType, puts back what Send, SendRequest and SendReply leave out on v5. 
+        static void Downgrade(shared::PayLoadType& payload, const mqtt::MessageProperties& properties);
+        static shared::PayLoadPtr ToPayload(const detail::ArgumentSourceType& stack);
+
+        void SetMethod(const std::string& FuncName, func_type func);
+        void RequestFailed(const std::string& FuncName);
         
         std::string     my_topic;
         std::string     peer_topic;
+        std::string     publish_topic; // peer_topic/my_topic
+        // whether the last message from the peer came in over v5, until then method names stay in the payload so v3.1.1 peers can read them.
+        std::atomic<bool> peer_v5{ false };
+        detail::CallCache call_cache;
+        std::atomic<uint64_t> next_request_id{ 0 };
+        std::function<void(const std::string&)> request_failed_handler;
+        // invalidations are only listened to once something is cacheable. 
+        bool invalidate_subscribed = false;
+
+        static const char* const request_method;
+        static const char* const reply_method;
+        // + topic of the peer serving the methods, shared by everyone calling it.
+        static const char* const invalidate_topic;
         dict_type       function_registry;
 
     };
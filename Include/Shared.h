@@ -4,6 +4,8 @@
 #include <memory>
 #include <atomic>
 #include <vector>
+#include <mutex>
+#include <unordered_map>
 
 namespace shared
 {
@@ -130,6 +132,213 @@ namespace shared
         void operator= (bounded_queue const&) = delete;
     };
 
+    // read-copy-update map. 
+    // readers are lock-free: they announce the table they use in a hazard slot, re-checking it is still current 
+    // (they only go round again if a write lands right then). writers copy the table, modify it and publish the copy. 
+    // a replaced table is freed once no hazard slot points at it, checked after every write and by the last reader 
+    // to let go of a table a writer had to leave behind. 
+    template<typename K, typename V>
+    class rcu_map
+    {
+    public:
+
+        typedef std::unordered_map<K, V> table_type;
+
+    private:
+
+        // one per concurrent reader, reused, freed with the map. 
+        struct hazard_slot
+        {
+            std::atomic<bool>               active_;
+            std::atomic<const table_type*>  table_;
+            hazard_slot*                    next_;
+        };
+
+    public:
+
+        class snapshot
+        {
+        public:
+            snapshot(const rcu_map& owner)
+                : owner_(&owner),
+                slot_(owner.acquire_slot())
+            {
+                const table_type* table = owner_->current_.load(std::memory_order_seq_cst);
+                for (;;)
+                {
+                    slot_->table_.store(table, std::memory_order_seq_cst);
+                    // a writer may have swapped the table before it could see our hazard. 
+                    const table_type* again = owner_->current_.load(std::memory_order_seq_cst);
+                    if (again == table)
+                        break;
+                    table = again;
+                }
+                table_ = table;
+            }
+
+            snapshot(snapshot&& other)
+                : owner_(other.owner_),
+                slot_(other.slot_),
+                table_(other.table_)
+            {
+                other.slot_ = nullptr;
+            }
+
+            ~snapshot()
+            {
+                if (slot_ != nullptr)
+                    owner_->release_slot(slot_);
+            }
+
+            // nullptr if not found. valid for the lifetime of the snapshot. 
+            const V* find(const K& key) const
+            {
+                auto it = table_->find(key);
+                return it != table_->end() ? &it->second : nullptr;
+            }
+
+        private:
+            const rcu_map* owner_;
+            hazard_slot* slot_;
+            const table_type* table_;
+
+            snapshot(snapshot const&) = delete;
+            void operator= (snapshot const&) = delete;
+        };
+
+        rcu_map()
+            : current_(new table_type())
+        {
+            slots_.store(nullptr, std::memory_order_relaxed);
+            retired_count_.store(0, std::memory_order_relaxed);
+        }
+
+        ~rcu_map()
+        {
+            delete current_.load(std::memory_order_relaxed);
+            for (auto table : retired_)
+                delete table;
+            auto slot = slots_.load(std::memory_order_relaxed);
+            while (slot != nullptr)
+            {
+                auto next = slot->next_;
+                delete slot;
+                slot = next;
+            }
+        }
+
+        snapshot read() const
+        {
+            return snapshot(*this);
+        }
+
+        void set(const K& key, V value)
+        {
+            std::lock_guard<std::mutex> guard(writer_lock_);
+            auto next = new table_type(*current_.load(std::memory_order_relaxed));
+            (*next)[key] = std::move(value);
+            publish(next);
+        }
+
+        // sets key only if allow(existing value or nullptr) agrees, checked under the writer lock. 
+        template<typename Pred>
+        bool set_if(const K& key, V value, Pred allow)
+        {
+            std::lock_guard<std::mutex> guard(writer_lock_);
+            auto current = current_.load(std::memory_order_relaxed);
+            auto it = current->find(key);
+            if (!allow(it != current->end() ? &it->second : nullptr))
+                return false;
+            auto next = new table_type(*current);
+            (*next)[key] = std::move(value);
+            publish(next);
+            return true;
+        }
+
+        bool erase(const K& key)
+        {
+            std::lock_guard<std::mutex> guard(writer_lock_);
+            auto current = current_.load(std::memory_order_relaxed);
+            if (current->find(key) == current->end())
+                return false;
+            auto next = new table_type(*current);
+            next->erase(key);
+            publish(next);
+            return true;
+        }
+
+    private:
+
+        hazard_slot* acquire_slot() const
+        {
+            for (auto slot = slots_.load(std::memory_order_acquire); slot != nullptr; slot = slot->next_)
+            {
+                bool expected = false;
+                if (!slot->active_.load(std::memory_order_relaxed) &&
+                    slot->active_.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                    return slot;
+            }
+
+            // every slot busy, add one. 
+            auto slot = new hazard_slot();
+            slot->active_.store(true, std::memory_order_relaxed);
+            slot->table_.store(nullptr, std::memory_order_relaxed);
+            slot->next_ = slots_.load(std::memory_order_relaxed);
+            while (!slots_.compare_exchange_weak(slot->next_, slot, std::memory_order_release, std::memory_order_relaxed))
+            {
+            }
+            return slot;
+        }
+
+        void release_slot(hazard_slot* slot) const
+        {
+            slot->table_.store(nullptr, std::memory_order_seq_cst);
+            slot->active_.store(false, std::memory_order_release);
+
+            // a writer had to leave tables behind, free them unless a writer is busy anyway. never waits. 
+            if (retired_count_.load(std::memory_order_relaxed) != 0 && writer_lock_.try_lock())
+            {
+                reclaim();
+                writer_lock_.unlock();
+            }
+        }
+
+        // writer_lock_ held. 
+        void publish(table_type* next)
+        {
+            retired_.push_back(current_.exchange(next, std::memory_order_seq_cst));
+            reclaim();
+        }
+
+        // writer_lock_ held. 
+        void reclaim() const
+        {
+            size_t kept = 0;
+            for (size_t ctr = 0; ctr < retired_.size(); ctr++)
+            {
+                bool in_use = false;
+                for (auto slot = slots_.load(std::memory_order_acquire); slot != nullptr && !in_use; slot = slot->next_)
+                    in_use = slot->table_.load(std::memory_order_seq_cst) == retired_[ctr];
+
+                if (in_use)
+                    retired_[kept++] = retired_[ctr];
+                else
+                    delete retired_[ctr];
+            }
+            retired_.resize(kept);
+            retired_count_.store(kept, std::memory_order_relaxed);
+        }
+
+        std::atomic<const table_type*>          current_;
+        mutable std::atomic<hazard_slot*>       slots_;
+        mutable std::mutex                      writer_lock_;
+        mutable std::vector<const table_type*>  retired_;
+        mutable std::atomic<size_t>             retired_count_;
+
+        rcu_map(rcu_map const&) = delete;
+        void operator= (rcu_map const&) = delete;
+    };
+
     // very basic mem pool. 
     template<typename T, int N>
     class MemPool
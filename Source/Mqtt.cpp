@@ -1,18 +1,91 @@
 #include "Mqtt.h"
-#include <mosquitto.h>
 #include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 
 namespace mqtt
 {
-    void MQTT::on_connect(int rc)
+    namespace
     {
-        // @todo. 
+        const char MethodIdDigits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz-_";
+
+        // method ids go out as at most 6 characters, user properties have to be UTF-8.
+        std::string EncodeMethodId(uint32_t id)
+        {
+            std::string encoded;
+            while (id != 0)
+            {
+                encoded.push_back(MethodIdDigits[id & 63]);
+                id >>= 6;
+            }
+            return encoded;
+        }
+
+        uint32_t DecodeMethodId(const char* encoded)
+        {
+            uint32_t id = 0;
+            int shift = 0;
+            for (; *encoded != '\0' && shift < 32; encoded++, shift += 6)
+            {
+                auto digit = std::strchr(MethodIdDigits, *encoded);
+                if (digit == nullptr)
+                    return 0;
+                id |= (uint32_t)(digit - MethodIdDigits) << shift;
+            }
+            return id;
+        }
+    }
+
+    MQTT::~MQTT()
+    {
+        if (handle != nullptr)
+        {
+            mosquitto_destroy(handle);
+            mosquitto_lib_cleanup();
+        }
+    }
+
+    void MQTT::on_connect(int rc, const mosquitto_property* props)
+    {
+        if (rc != 0)
+        {
+            bool unsupported = rc == CONNACK_REFUSED_PROTOCOL_VERSION || rc == MQTT_RC_UNSUPPORTED_PROTOCOL_VERSION;
+            if (unsupported && Version == Protocol::V5)
+            {
+                // broker only speaks v3.1.1, retry with that straight away.
+                Version = Protocol::V311;
+                mosquitto_int_option(handle, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V311);
+                ReconnectDelay = MinReconnectDelay;
+            }
+            // refused by the broker, keep backing off.
+            ConnectionLost();
+            return;
+        }
+
+        ConnectionState = State::Connected;
+        ReconnectDelay = MinReconnectDelay;
+
+        // aliases don't survive the connection. brokers that don't send a maximum allow none.
+        TopicAliases.clear();
+        TopicAliasMaximum = 0;
+        if (props != nullptr)
+        {
+            mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &TopicAliasMaximum, false);
+        }
+
+        // sessions are clean, so the broker forgot everything - replay the whole table.
+        PendingSubscriptions.clear();
+        SubscriptionsInFlight.clear();
+        for (auto it = MessageHandlers.begin(); it != MessageHandlers.end(); it = MessageHandlers.upper_bound(it->first))
+        {
+            PendingSubscriptions.push_back(it->first);
+        }
     }
 
     void MQTT::on_disconnect(int rc)
     {
-        // @todo. 
+        ConnectionLost();
     }
 
     MQTT& MQTT::Instance()
@@ -21,54 +94,321 @@ namespace mqtt
         return Broker;
     }
 
-    void MQTT::Connect(const std::string& clientid, const std::string& ip, const int port)
+    void MQTT::Connect(const std::string& clientid, const std::string& ip, const int port, const Protocol protocol)
+    {
+        mosquitto_lib_init();
+        if (handle != nullptr)
+        {
+            mosquitto_destroy(handle);
+        }
+        handle = mosquitto_new(clientid.data(), true, this);
+        assert(handle != nullptr);
+
+        Version = protocol;
+        if (Version == Protocol::V5)
+        {
+            mosquitto_int_option(handle, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+        }
+
+        // v5 callbacks fire for v3.1.1 connections too, with no properties.
+        mosquitto_connect_v5_callback_set(handle, [](struct mosquitto*, void* obj, int rc, int, const mosquitto_property* props) {
+            static_cast<MQTT*>(obj)->on_connect(rc, props);
+        });
+        mosquitto_disconnect_callback_set(handle, [](struct mosquitto*, void* obj, int rc) {
+            static_cast<MQTT*>(obj)->on_disconnect(rc);
+        });
+        mosquitto_subscribe_callback_set(handle, [](struct mosquitto*, void* obj, int mid, int qos_count, const int* granted_qos) {
+            static_cast<MQTT*>(obj)->on_subscribe(mid, qos_count, granted_qos);
+        });
+        mosquitto_message_v5_callback_set(handle, [](struct mosquitto*, void* obj, const struct mosquitto_message* message, const mosquitto_property* props) {
+            static_cast<MQTT*>(obj)->on_message(message, props);
+        });
+
+        ReconnectDelay = MinReconnectDelay;
+
+        // the TCP connect and handshake complete in Loop (name resolution is still synchronous).
+        // a failed first attempt is retried like a dropped connection.
+        StartConnecting(mosquitto_connect_async(handle, ip.data(), port, 60));
+    }
+
+    void MQTT::Subscribe(const std::string& topic, MessageHandlerType message_handler)
     {
-        mosqpp::lib_init();
-        reinitialise(clientid.data(), true);
-        auto res = connect(ip.data(), port, 60);
-        assert(res == MOSQ_ERR_SUCCESS);
+        Subscribe(topic, [message_handler](const shared::PayLoadSharedPtr payload, const std::string& topic, const MessageProperties&) {
+            message_handler(payload, topic);
+        });
     }
 
-    void MQTT::Subscribe(const std::string& topic, std::function<void(const shared::PayLoadSharedPtr, const std::string& topic)> message_handler)
+    void MQTT::Subscribe(const std::string& topic, MessageHandlerWithPropertiesType message_handler)
     {
+        bool known = MessageHandlers.find(topic) != MessageHandlers.end();
         MessageHandlers.insert(std::make_pair(topic, message_handler));
-        int RetVal = subscribe(NULL, topic.data(), 0);
+        // batched up and sent from Loop.
+        if (!known)
+        {
+            PendingSubscriptions.push_back(topic);
+        }
     }
 
-    void MQTT::PublishAsync(const std::string& topic, shared::PayLoadPtr payload)
+    bool MQTT::PublishAsync(const std::string& topic, shared::PayLoadPtr payload, MessageProperties properties)
     {
         auto Ptr = new  AsyncData();
         Ptr->payload = std::move(payload);
         Ptr->topic = topic; 
-        ToPublishQueue.enqueue(std::move(Ptr));
+        Ptr->properties = std::move(properties);
+        if (!ToPublishQueue.enqueue(std::move(Ptr)))
+        {
+            // queue is full, e.g. after a long outage.
+            delete Ptr;
+            Dropped++;
+            return false;
+        }
+        return true;
+    }
+
+    int MQTT::Publish(AsyncData& data)
+    {
+        if (Version != Protocol::V5)
+        {
+            // queued while on v5, the method can't travel as a property anymore.
+            if (data.properties.method_id != 0)
+            {
+                if (!DowngradeHandler)
+                    return MOSQ_ERR_NOT_SUPPORTED;
+                DowngradeHandler(*data.payload, data.properties);
+                data.properties.method_id = 0;
+                data.properties.correlation.clear();
+            }
+            return mosquitto_publish(handle, nullptr, data.topic.c_str(), (int)data.payload->size(), data.payload->data(), 0, false);
+        }
+
+        mosquitto_property* props = nullptr;
+        const char* topic = data.topic.c_str();
+
+        // first publish to a topic binds an alias, repeats send the 2 byte alias instead of the topic.
+        uint16_t new_alias = 0;
+        auto alias = TopicAliases.find(data.topic);
+        if (alias != TopicAliases.end())
+        {
+            mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, alias->second);
+            topic = nullptr;
+        }
+        else if (TopicAliases.size() < TopicAliasMaximum)
+        {
+            new_alias = (uint16_t)(TopicAliases.size() + 1);
+            mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, new_alias);
+        }
+
+        if (data.properties.has_method)
+        {
+            mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "m", EncodeMethodId(data.properties.method_id).c_str());
+        }
+        if (!data.properties.correlation.empty())
+        {
+            mosquitto_property_add_binary(&props, MQTT_PROP_CORRELATION_DATA, data.properties.correlation.data(), (uint16_t)data.properties.correlation.size());
+        }
+
+        int res = mosquitto_publish_v5(handle, nullptr, topic, (int)data.payload->size(), data.payload->data(), 0, false, props);
+        mosquitto_property_free_all(&props);
+
+        if (res == MOSQ_ERR_SUCCESS && new_alias != 0)
+        {
+            TopicAliases[data.topic] = new_alias;
+        }
+        return res;
+    }
+
+    void MQTT::FlushSubscriptions()
+    {
+        size_t sent = 0;
+        std::vector<char*> topics;
+
+        while (sent < PendingSubscriptions.size())
+        {
+            size_t count = std::min(PendingSubscriptions.size() - sent, (size_t)MaxTopicsPerSubscribe);
+
+            topics.clear();
+            for (size_t ctr = sent; ctr < sent + count; ctr++)
+            {
+                topics.push_back(const_cast<char*>(PendingSubscriptions[ctr].c_str()));
+            }
+
+            int mid = 0;
+            int res = mosquitto_subscribe_multiple(handle, &mid, (int)count, topics.data(), 0, 0, nullptr);
+            if (res != MOSQ_ERR_SUCCESS)
+                break; // whatever is left goes out on the next tick or the next connect.
+
+            SubscriptionsInFlight[mid].assign(PendingSubscriptions.begin() + sent, PendingSubscriptions.begin() + sent + count);
+
+            sent += count;
+        }
+
+        PendingSubscriptions.erase(PendingSubscriptions.begin(), PendingSubscriptions.begin() + sent);
+    }
+
+    void MQTT::on_subscribe(int mid, int qos_count, const int* granted_qos)
+    {
+        auto request = SubscriptionsInFlight.find(mid);
+        if (request == SubscriptionsInFlight.end())
+            return;
+
+        // SUBACK codes line up with the topics of the request, 0x80 and up is a refusal.
+        for (int ctr = 0; ctr < qos_count && ctr < (int)request->second.size(); ctr++)
+        {
+            if (granted_qos[ctr] >= 0x80)
+                ReportError(request->second[ctr], granted_qos[ctr]);
+        }
+        SubscriptionsInFlight.erase(request);
+    }
+
+    void MQTT::SetErrorHandler(ErrorHandlerType handler)
+    {
+        ErrorHandler = handler;
+    }
+
+    void MQTT::SetDowngradeHandler(DowngradeHandlerType handler)
+    {
+        DowngradeHandler = handler;
+    }
+
+    void MQTT::AddTicker(std::function<void()> ticker)
+    {
+        Tickers.push_back(std::move(ticker));
+    }
+
+    void MQTT::ReportError(const std::string& topic, int rc)
+    {
+        if (ErrorHandler)
+            ErrorHandler(topic, rc);
+    }
+
+    void MQTT::ScheduleReconnect()
+    {
+        NextReconnect = Clock::now() + ReconnectDelay;
+        ReconnectDelay = std::min(ReconnectDelay * 2, MaxReconnectDelay);
+    }
+
+    void MQTT::ConnectionLost()
+    {
+        if (ConnectionState != State::Disconnected)
+        {
+            ConnectionState = State::Disconnected;
+            ScheduleReconnect();
+        }
+    }
+
+    void MQTT::StartConnecting(int res)
+    {
+        if (res == MOSQ_ERR_SUCCESS)
+        {
+            ConnectionState = State::Connecting;
+            ConnectDeadline = Clock::now() + ConnectTimeout;
+        }
+        else
+        {
+            ConnectionState = State::Disconnected;
+            ScheduleReconnect();
+        }
+    }
+
+    void MQTT::TryReconnect()
+    {
+        if (ConnectionState == State::Connecting)
+        {
+            // leave a handshake in progress alone unless it's clearly stuck.
+            if (Clock::now() >= ConnectDeadline)
+                ConnectionLost();
+            return;
+        }
+
+        if (Clock::now() < NextReconnect)
+            return;
+
+        StartConnecting(mosquitto_reconnect_async(handle));
     }
 
     void MQTT::Loop()
     {
+        if (handle == nullptr)
+            return;
+
+        if (ConnectionState != State::Connected)
+        {
+            TryReconnect();
+        }
+        else
         {
-            // publish whatever is queued, one at a time. 
-            AsyncData* data = nullptr;
-            if (ToPublishQueue.try_dequeue(data))
+            FlushSubscriptions();
+
+            // publish whatever is queued, outbound calls stay queued while the broker is away.
+            AsyncData* data = HeldPublish;
+            HeldPublish = nullptr;
+            while (data != nullptr || ToPublishQueue.try_dequeue(data))
             {
-                int res = publish(nullptr, data->topic.c_str(), (int)data->payload->size(), data->payload->data(), 0, false);
-                assert(res == MOSQ_ERR_SUCCESS);
+                int res = Publish(*data);
+                if (res == MOSQ_ERR_NO_CONN || res == MOSQ_ERR_CONN_LOST)
+                {
+                    HeldPublish = data;
+                    ConnectionLost();
+                    break;
+                }
+                if (res != MOSQ_ERR_SUCCESS)
+                {
+                    // can't ever go out, e.g. payload too large.
+                    Dropped++;
+                    ReportError(data->topic, res);
+                }
                 delete data;
+                data = nullptr;
             }
         }
         {
             // tick mqtt. 
-            // add reconnect logic here. @todo.
-            int res = loop(0);
-            assert(res == MOSQ_ERR_SUCCESS);
-            // @todo - reconnect logic. 
+            int res = mosquitto_loop(handle, 0, 1);
+            if (res != MOSQ_ERR_SUCCESS)
+            {
+                ConnectionLost();
+            }
         }
+
+        for (auto& ticker : Tickers)
+            ticker();
     }
-    void MQTT::on_message(const mosquitto_message *message)
+    void MQTT::on_message(const mosquitto_message *message, const mosquitto_property* props)
     {
         std::shared_ptr<shared::PayLoadType> payload(new shared::PayLoadType);
         std::copy((uint8_t*)message->payload, (uint8_t*)message->payload + message->payloadlen, std::back_inserter(*payload));
         std::string Key(message->topic);
 
+        MessageProperties properties;
+        if (props != nullptr)
+        {
+            char* name = nullptr;
+            char* value = nullptr;
+            auto prop = mosquitto_property_read_string_pair(props, MQTT_PROP_USER_PROPERTY, &name, &value, false);
+            while (prop != nullptr)
+            {
+                bool found = std::strcmp(name, "m") == 0;
+                if (found)
+                {
+                    properties.has_method = true;
+                    properties.method_id = DecodeMethodId(value);
+                }
+                free(name);
+                free(value);
+                if (found)
+                    break;
+                prop = mosquitto_property_read_string_pair(prop, MQTT_PROP_USER_PROPERTY, &name, &value, true);
+            }
+
+            void* correlation = nullptr;
+            uint16_t len = 0;
+            if (mosquitto_property_read_binary(props, MQTT_PROP_CORRELATION_DATA, &correlation, &len, false) != nullptr)
+            {
+                properties.correlation.assign((uint8_t*)correlation, (uint8_t*)correlation + len);
+                free(correlation);
+            }
+        }
+
         if (MessageHandlers.find(Key) != MessageHandlers.end())
         {
             for (auto KVP : MessageHandlers)
@@ -86,7 +426,7 @@ namespace mqtt
 
         for (auto it = range.first; it != range.second; ++it)
         {
-            it->second(payload, message->topic);
+            it->second(payload, message->topic, properties);
         }
     }
 }
\ No newline at end of file
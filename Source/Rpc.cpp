@@ -1,6 +1,8 @@
 #include <functional>
 #include <iostream>
 #include <sstream>
+#include <random>
+#include <stdexcept>
 #include "Rpc.h"
 #include "Shared.h"
 #include "Mqtt.h"
@@ -9,15 +11,224 @@ namespace rpc
 {
 
     std::string PeerConnection::source_topic_in_progress;
+    const char* const PeerConnection::request_method = "__mqttrpc_request";
+    const char* const PeerConnection::reply_method = "__mqttrpc_reply";
+    const char* const PeerConnection::invalidate_topic = "mqttrpc/invalidate/";
+
+    namespace
+    {
+        // request id as v5 correlation data, little endian. 
+        std::vector<uint8_t> EncodeCorrelation(uint64_t id)
+        {
+            std::vector<uint8_t> correlation(8);
+            for (size_t ctr = 0; ctr < correlation.size(); ctr++)
+                correlation[ctr] = (uint8_t)(id >> (8 * ctr));
+            return correlation;
+        }
+
+        bool DecodeCorrelation(const std::vector<uint8_t>& correlation, uint64_t& id)
+        {
+            if (correlation.size() != 8)
+                return false;
+            id = 0;
+            for (size_t ctr = 0; ctr < correlation.size(); ctr++)
+                id |= (uint64_t)correlation[ctr] << (8 * ctr);
+            return true;
+        }
+    }
+
+    namespace detail
+    {
+        void CallCache::SetTTL(const std::string& method, std::chrono::milliseconds ttl)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ttls[method] = ttl;
+        }
+
+        CallCache::Lookup CallCache::Begin(const std::string& method, const std::vector<uint8_t>& args, ResultHandler handler, uint64_t id, std::vector<uint8_t>& result)
+        {
+            auto now = Clock::now();
+
+            std::lock_guard<std::mutex> guard(lock);
+
+            InFlight request;
+            request.method = method;
+            request.deadline = now + RequestTimeout;
+            request.cacheable = false;
+
+            auto ttl = ttls.find(method);
+            if (ttl != ttls.end())
+            {
+                std::string key(method);
+                key.push_back('\0');
+                key.append(args.begin(), args.end());
+
+                auto found = index.find(key);
+                if (found != index.end())
+                {
+                    if (found->second->expires > now)
+                    {
+                        lru.splice(lru.begin(), lru, found->second);
+                        result = found->second->result;
+                        return Lookup::Hit;
+                    }
+                    lru.erase(found->second);
+                    index.erase(found);
+                }
+
+                // concurrent identical requests merge into the first one. 
+                auto pending = in_flight_keys.find(key);
+                if (pending != in_flight_keys.end())
+                {
+                    in_flight[pending->second].handlers.push_back(std::move(handler));
+                    return Lookup::Joined;
+                }
+
+                in_flight_keys[key] = id;
+                request.key = std::move(key);
+                request.cacheable = true;
+            }
+
+            request.handlers.push_back(std::move(handler));
+            deadlines.emplace_back(request.deadline, id);
+            in_flight[id] = std::move(request);
+            pending = in_flight.size();
+            return Lookup::Send;
+        }
+
+        size_t CallCache::Cancel(uint64_t id)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto request = in_flight.find(id);
+            if (request == in_flight.end())
+                return 0;
+
+            auto dropped = request->second.handlers.size();
+            Forget(request);
+            return dropped;
+        }
+
+        std::vector<std::string> CallCache::Expire()
+        {
+            // polled every Loop, don't take the lock for nothing. 
+            if (pending.load(std::memory_order_relaxed) == 0)
+                return {};
+
+            auto now = Clock::now();
+            std::vector<std::string> expired;
+
+            std::lock_guard<std::mutex> guard(lock);
+            while (!deadlines.empty() && deadlines.front().first <= now)
+            {
+                auto request = in_flight.find(deadlines.front().second);
+                deadlines.pop_front();
+                if (request == in_flight.end())
+                    continue; // answered or cancelled already. 
+
+                expired.insert(expired.end(), request->second.handlers.size(), request->second.method);
+                Forget(request);
+            }
+            return expired;
+        }
+
+        std::vector<ResultHandler> CallCache::Complete(uint64_t id, const std::vector<uint8_t>& result)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            auto request = in_flight.find(id);
+            if (request == in_flight.end())
+                return {};
+
+            auto handlers = std::move(request->second.handlers);
+
+            auto ttl = ttls.find(request->second.method);
+            if (request->second.cacheable && ttl != ttls.end())
+            {
+                auto& key = request->second.key;
+                auto found = index.find(key);
+                if (found != index.end())
+                {
+                    lru.erase(found->second);
+                    index.erase(found);
+                }
+
+                lru.push_front({ key, request->second.method, Clock::now() + ttl->second, result });
+                index[key] = lru.begin();
+
+                if (lru.size() > capacity)
+                {
+                    index.erase(lru.back().key);
+                    lru.pop_back();
+                }
+            }
+
+            Forget(request);
+            return handlers;
+        }
+
+        void CallCache::Invalidate(const std::string& method)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto it = lru.begin(); it != lru.end();)
+            {
+                if (it->method == method)
+                {
+                    index.erase(it->key);
+                    it = lru.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+
+            // replies already on their way may be stale too, deliver them but don't cache or merge into them. 
+            for (auto& request : in_flight)
+            {
+                if (request.second.cacheable && request.second.method == method)
+                {
+                    in_flight_keys.erase(request.second.key);
+                    request.second.cacheable = false;
+                }
+            }
+        }
+
+        std::unordered_map<uint64_t, CallCache::InFlight>::iterator CallCache::Forget(std::unordered_map<uint64_t, InFlight>::iterator request)
+        {
+            if (request->second.cacheable)
+                in_flight_keys.erase(request->second.key);
+            auto next = in_flight.erase(request);
+            pending = in_flight.size();
+            // nothing left to time out, stale deadlines can go. 
+            if (in_flight.empty())
+                deadlines.clear();
+            return next;
+        }
+    }
 
     void PeerConnection::Init(const std::string InYourTopic, const std::string InPeerTopic)
     {
         my_topic        = InYourTopic;
         peer_topic      = InPeerTopic;
+        publish_topic   = peer_topic + "/" + my_topic;
 
         // listen for messages from the peer directed towards me. 
         mqtt::MQTT::Instance().Subscribe(my_topic + "/" + peer_topic,
-            [&](const shared::PayLoadSharedPtr payload, const std::string& topic) {
+            [&](const shared::PayLoadSharedPtr payload, const std::string& topic, const mqtt::MessageProperties& properties) {
+
+            // a v3.1.1 sender, or one that fell back to it, needs names in the payload again. 
+            peer_v5 = properties.has_method;
+
+            uint64_t request_id = 0;
+            bool correlated = DecodeCorrelation(properties.correlation, request_id);
+
+            // reply to one of our Requests, v5 form. the payload is the result itself. 
+            if (correlated && properties.method_id == detail::MethodId(reply_method))
+            {
+                for (auto& handler : call_cache.Complete(request_id, *payload))
+                    handler(*payload);
+                return;
+            }
 
             auto NVPs = payload->data();
 
@@ -31,22 +242,216 @@ namespace rpc
             }
 
             std::string ret;
+            std::string name;
+            uint32_t id = properties.method_id;
 
-            auto func_name = queue.top();
-
-            std::string name((char*)func_name.data(), func_name.size());
-
-            queue.pop();
+            if (id == 0)
+            {
+                // a v5 call without its name reaching a v3.1.1 connection can come in empty.
+                if (queue.empty())
+                    return;
+                auto func_name = queue.top();
+                name.assign((char*)func_name.data(), func_name.size());
+                queue.pop();
+                id = detail::MethodId(name);
+            }
 
-            if (function_registry.find(name) != function_registry.end())
+            // lock-free snapshot, Bind/Unbind from other threads publish a new table without disturbing this one. 
+            auto registry = function_registry.read();
+            auto method = registry.find(id);
+            if (method != nullptr && (name.empty() || method->name == name))
             {
                 source_topic_in_progress = topic;
-                auto Fptr = function_registry[name];
-                Fptr(queue, &ret);
+                // a Request, v5 form. 
+                method->func(queue, correlated ? &ret : nullptr);
                 source_topic_in_progress = "";
+
+                if (correlated)
+                    SendReply(request_id, ret);
             }
         }
 
         ); // topic: from/to
+
+        // random start, replies are seen by everyone sharing my_topic. 
+        std::random_device random;
+        next_request_id = ((uint64_t)random() << 32) | random();
+
+        // serve a Request from the peer. 
+        Bind(request_method, [this](uint64_t id, const std::string& name, const std::vector<uint8_t>& arguments) {
+            auto args = detail::from_bytes<detail::ArgumentSourceType>(arguments);
+
+            auto registry = function_registry.read();
+            auto method = registry.find(detail::MethodId(name));
+            if (method == nullptr || method->name != name)
+                return;
+
+            std::string ret;
+            method->func(args, &ret);
+            SendReply(id, ret);
+        });
+
+        // reply to one of our Requests, v3.1.1 form. 
+        Bind(reply_method, [this](uint64_t id, const std::vector<uint8_t>& result) {
+            for (auto& handler : call_cache.Complete(id, result))
+                handler(result);
+        });
+
+        // messages we queue while on v5 may still go out after a fall back to v3.1.1. 
+        mqtt::MQTT::Instance().SetDowngradeHandler(&PeerConnection::Downgrade);
+
+        // time out unanswered Requests. 
+        mqtt::MQTT::Instance().AddTicker([this]() {
+            for (auto& func_name : call_cache.Expire())
+                RequestFailed(func_name);
+        });
+    }
+
+    bool PeerConnection::PeerTakesIds() const
+    {
+        return mqtt::MQTT::Instance().IsV5() && peer_v5;
+    }
+
+    bool PeerConnection::Send(const std::string& func_name, detail::ArgumentSourceType stack)
+    {
+        auto& mqtt_instance = mqtt::MQTT::Instance();
+        mqtt::MessageProperties properties;
+
+        // marks us as v5 to the peer.
+        properties.has_method = mqtt_instance.IsV5();
+
+        if (PeerTakesIds())
+        {
+            // peer has shown it speaks v5, only the method id goes out, as a property.
+            properties.method_id = detail::MethodId(func_name);
+            properties.method = func_name;
+        }
+        else
+        {
+            // push function name.
+            stack.push(std::vector<uint8_t>(func_name.begin(), func_name.end()));
+        }
+        // put the payload on the wire.
+        return mqtt_instance.PublishAsync(publish_topic, ToPayload(stack), std::move(properties));
+    }
+
+    bool PeerConnection::SendRequest(uint64_t id, const std::string& func_name, const std::vector<uint8_t>& arguments)
+    {
+        if (!PeerTakesIds())
+            return Call(request_method, id, func_name, arguments);
+
+        mqtt::MessageProperties properties;
+        properties.has_method = true;
+        properties.method_id = detail::MethodId(func_name);
+        properties.method = func_name;
+        properties.correlation = EncodeCorrelation(id);
+
+        // the serialized arguments are exactly the payload of a plain call. 
+        shared::PayLoadPtr payload(new shared::PayLoadType(arguments));
+        return mqtt::MQTT::Instance().PublishAsync(publish_topic, std::move(payload), std::move(properties));
+    }
+
+    bool PeerConnection::SendReply(uint64_t id, const std::string& result)
+    {
+        if (!PeerTakesIds())
+            return Call(reply_method, id, std::vector<uint8_t>(result.begin(), result.end()));
+
+        mqtt::MessageProperties properties;
+        properties.has_method = true;
+        properties.method_id = detail::MethodId(reply_method);
+        properties.method = reply_method;
+        properties.correlation = EncodeCorrelation(id);
+
+        shared::PayLoadPtr payload(new shared::PayLoadType(result.begin(), result.end()));
+        return mqtt::MQTT::Instance().PublishAsync(publish_topic, std::move(payload), std::move(properties));
+    }
+
+    void PeerConnection::Downgrade(shared::PayLoadType& payload, const mqtt::MessageProperties& properties)
+    {
+        detail::ArgumentSourceType stack;
+        std::string func_name = properties.method;
+
+        uint64_t id = 0;
+        if (DecodeCorrelation(properties.correlation, id))
+        {
+            // back to the request_method / reply_method wrappers. 
+            if (properties.method == reply_method)
+            {
+                stack = PackArguments(id, payload);
+            }
+            else
+            {
+                stack = PackArguments(id, properties.method, payload);
+                func_name = request_method;
+            }
+        }
+        else
+        {
+            stack = detail::from_bytes<detail::ArgumentSourceType>(payload);
+        }
+
+        stack.push(std::vector<uint8_t>(func_name.begin(), func_name.end()));
+        payload = std::move(*ToPayload(stack));
+    }
+
+    shared::PayLoadPtr PeerConnection::ToPayload(const detail::ArgumentSourceType& stack)
+    {
+        //  serialize stack. 
+        std::stringstream ss(std::stringstream::in | std::stringstream::out | std::stringstream::binary);
+        {
+            cereal::BinaryOutputArchive output(ss);
+            output(stack);
+        }
+        // copy the stringstream to the payload.
+        shared::PayLoadPtr payload(new shared::PayLoadType());
+        std::copy(std::istreambuf_iterator<char>(ss), std::istreambuf_iterator<char>(), std::back_inserter(*payload));
+        return payload;
+    }
+
+    void PeerConnection::RequestFailed(const std::string& FuncName)
+    {
+        if (request_failed_handler)
+            request_failed_handler(FuncName);
+    }
+
+    void PeerConnection::OnRequestFailed(std::function<void(const std::string& func_name)> handler)
+    {
+        request_failed_handler = std::move(handler);
+    }
+
+    void PeerConnection::SetMethod(const std::string& FuncName, func_type func)
+    {
+        // two names sharing an id can't be told apart on v5. checked under the registry's writer lock. 
+        bool bound = function_registry.set_if(detail::MethodId(FuncName), BoundMethod{ FuncName, std::move(func) },
+            [&](const BoundMethod* existing) { return existing == nullptr || existing->name == FuncName; });
+        if (!bound)
+            throw std::invalid_argument("mqttrpc: method id of " + FuncName + " collides with another bound method");
+    }
+
+    bool PeerConnection::Unbind(const std::string& FuncName)
+    {
+        return function_registry.erase(detail::MethodId(FuncName));
+    }
+
+    void PeerConnection::SetCacheable(const std::string& FuncName, std::chrono::milliseconds ttl)
+    {
+        call_cache.SetTTL(FuncName, ttl);
+
+        if (invalidate_subscribed)
+            return;
+        invalidate_subscribed = true;
+
+        // peer says replies of one of its methods went stale. 
+        mqtt::MQTT::Instance().Subscribe(invalidate_topic + peer_topic,
+            [this](const shared::PayLoadSharedPtr payload, const std::string&) {
+            call_cache.Invalidate(std::string(payload->begin(), payload->end()));
+        });
+    }
+
+    bool PeerConnection::Invalidate(const std::string& FuncName)
+    {
+        // one publish reaches every peer of my_topic, whichever connection it goes through. 
+        shared::PayLoadPtr payload(new shared::PayLoadType(FuncName.begin(), FuncName.end()));
+        return mqtt::MQTT::Instance().PublishAsync(invalidate_topic + my_topic, std::move(payload));
     }
 }
\ No newline at end of file